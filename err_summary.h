@@ -0,0 +1,89 @@
+/*
+ * Deferred summary of the errors met on a hot path
+ * Copyright (C) 2016  Miquèl Raynal
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _ERR_SUMMARY_H
+#define _ERR_SUMMARY_H
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+
+/*
+ * Printing on the serial console costs milliseconds, so the failing path
+ * only bumps a counter and a deferred work prints one line per error kind
+ * Errors expected on the I2C bus are counted apart, the others together
+ */
+enum { ERR_IO, ERR_TIMEDOUT, ERR_OTHER, ERR_COUNT };
+
+struct err_summary {
+	const char *name; /* path the errors come from */
+	int interval_ms;
+	atomic_t count[ERR_COUNT];
+	struct delayed_work work;
+};
+
+static void err_summary_report(struct work_struct *work)
+{
+	static const char * const names[ERR_COUNT] = {
+		"EIO", "ETIMEDOUT", "other",
+	};
+	struct err_summary *s = container_of(work, struct err_summary,
+					work.work);
+	int slot, count;
+
+	for (slot = 0; slot < ERR_COUNT; ++slot) {
+		count = atomic_xchg(&s->count[slot], 0);
+		if (count)
+			pr_err("%s: %d %s errors in the last %d ms\n",
+				s->name, count, names[slot], s->interval_ms);
+	}
+}
+
+static inline void err_summary_init(struct err_summary *s, const char *name,
+				int interval_ms)
+{
+	s->name = name;
+	s->interval_ms = interval_ms;
+	INIT_DELAYED_WORK(&s->work, err_summary_report);
+}
+
+static inline void err_summary_count(struct err_summary *s, int err)
+{
+	int slot = ERR_OTHER;
+
+	if (err == -EIO)
+		slot = ERR_IO;
+	else if (err == -ETIMEDOUT)
+		slot = ERR_TIMEDOUT;
+
+	atomic_inc(&s->count[slot]);
+	schedule_delayed_work(&s->work, msecs_to_jiffies(s->interval_ms));
+}
+
+/* Prints the pending summary, before the structure is freed */
+static inline void err_summary_flush(struct err_summary *s)
+{
+	if (cancel_delayed_work_sync(&s->work))
+		err_summary_report(&s->work.work);
+}
+
+#endif /* _ERR_SUMMARY_H */
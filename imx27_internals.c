@@ -23,6 +23,9 @@
 #include <linux/proc_fs.h>
 #include <linux/ioport.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/sys_soc.h>
 #include <asm/io.h>
 
 MODULE_LICENSE("GPL");
@@ -40,6 +43,11 @@ MODULE_DESCRIPTION("i.MX27 specific module retrieving internal values");
 #define IIM_SUID      (IIM_BASE + 0x0C04)
 #define PROC_BUF_SIZE 200
 
+/* Fields of the chip ID register */
+#define CHIP_ID_VERSION(id)  (((id) >> 28) & 0xF)
+#define CHIP_ID_PART(id)     (((id) >> 12) & 0xFFFF)
+#define CHIP_ID_PART_MX27    0x8821
+
 struct phys_reg {
 	char name[20];
 	int address;
@@ -182,6 +190,69 @@ static int read_reg(struct phys_reg *reg)
 		return read_reg_mem(reg);
 }
 
+/* Chip revisions indexed by the version field of the chip ID register */
+static const char * const mx27_revisions[] = { "1.0", "2.0", "2.1" };
+
+static struct soc_device_attribute soc_dev_attr;
+static struct soc_device *soc_dev;
+
+static void soc_free_attr(void)
+{
+	kfree(soc_dev_attr.revision);
+	kfree(soc_dev_attr.serial_number);
+	soc_dev_attr.revision = NULL;
+	soc_dev_attr.serial_number = NULL;
+}
+
+/*
+ * Registers a soc_device from the chip ID, silicon revision and unique ID
+ * This allows drivers to use soc_device_match() for silicon quirks and
+ * exposes the standard attributes in /sys/devices/soc0
+ */
+static int soc_register(void)
+{
+	u32 id = registers[CHIP_ID].value;
+	unsigned int version = CHIP_ID_VERSION(id);
+
+	/* Only log it: this module is only ever loaded on i.MX27 boards */
+	if (CHIP_ID_PART(id) != CHIP_ID_PART_MX27)
+		pr_err("Unknown part number 0x%X in chip ID\n", CHIP_ID_PART(id));
+
+	soc_dev_attr.family = "Freescale i.MX";
+	soc_dev_attr.soc_id = "i.MX27";
+
+	/* Unknown mask version: fallback on the raw silicon revision fuse */
+	if (version < ARRAY_SIZE(mx27_revisions))
+		soc_dev_attr.revision = kstrdup(mx27_revisions[version],
+						GFP_KERNEL);
+	else
+		soc_dev_attr.revision = kasprintf(GFP_KERNEL, "0x%02llX",
+						registers[SREV].value);
+	soc_dev_attr.serial_number = kasprintf(GFP_KERNEL, "%012llX",
+					registers[SUID].value);
+	if (!soc_dev_attr.revision || !soc_dev_attr.serial_number) {
+		soc_free_attr();
+		return -ENOMEM;
+	}
+
+	soc_dev = soc_device_register(&soc_dev_attr);
+	if (IS_ERR(soc_dev)) {
+		soc_free_attr();
+		return PTR_ERR(soc_dev);
+	}
+
+	return 0;
+}
+
+static void soc_unregister(void)
+{
+	if (IS_ERR_OR_NULL(soc_dev))
+		return;
+
+	soc_device_unregister(soc_dev);
+	soc_free_attr();
+}
+
 static int registers_show(struct seq_file *m, void *v)
 {
 	int i;
@@ -212,16 +283,31 @@ static const struct file_operations proc_file_fops = {
 static int __init internals_init(void)
 {
 	int i, ret;
+	int missing = 0;
 
 	for (i = 0; i < ENUM_REG_COUNT; ++i) {
 		ret = read_reg(&registers[i]);
-		if (ret < 0)
+		if (ret < 0) {
+			if ((i == CHIP_ID) || (i == SREV) || (i == SUID))
+				missing++;
 			continue;
+		}
 		pr_info("%s: 0x%llX\n", registers[i].name, registers[i].value);
 	}
 
-	if (!proc_create("internal_registers", 0444, NULL, &proc_file_fops))
+	/* The proc file remains usable even without the soc device */
+	if (missing) {
+		pr_err("Missing registers, soc device not registered\n");
+	} else {
+		ret = soc_register();
+		if (ret < 0)
+			pr_err("Unable to register soc device (%d)\n", ret);
+	}
+
+	if (!proc_create("internal_registers", 0444, NULL, &proc_file_fops)) {
+		soc_unregister();
 		return -ENOMEM;
+	}
 
 	return 0;
 }
@@ -229,6 +315,7 @@ static int __init internals_init(void)
 static void __exit internals_exit(void)
 {
 	remove_proc_entry("internal_registers", NULL);
+	soc_unregister();
 	return;
 }
 
@@ -25,9 +25,18 @@
 #include <linux/slab.h>
 #include <linux/gpio.h>
 #include <linux/of_platform.h>
+#include <linux/platform_device.h>
 #include <linux/delay.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/irqflags.h>
+#include <linux/workqueue.h>
 #include <asm/io.h>
 
+#define CREATE_TRACE_POINTS
+#include "odo_trace.h"
+#include "odo_sample.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Miquèl Raynal <miquel.raynal@navocap.com>");
 MODULE_DESCRIPTION("Reads the pulses from an odometer on a timer");
@@ -38,6 +47,10 @@ MODULE_DESCRIPTION("Reads the pulses from an odometer on a timer");
 #define GPT_TIN        {79, 79, 79, 91, 89, 78}
 #define MEM_LENGTH     0x18
 
+// Peripheral clock control register, GPT1 gate is bit 24 down to GPT6 on 19
+#define PCCR0          0x10027020
+#define PCCR0_GPT(id)  (1 << (25 - (id)))
+
 #define TCTL_REG   0x0
 #define TPRER_REG  0x4
 #define TCMP_REG   0x8
@@ -58,17 +71,30 @@ struct _odo {
 	struct kobject *kobj;
 	unsigned long gpt_base;
 	void __iomem *vmem;
+	spinlock_t lock; /* protects the carry evaluation */
 	unsigned long counter_ms;
 	unsigned long counter_ls;
+	u64 base; /* count accumulated before a loss of the GPT context */
+	u64 saved;
+	u32 saved_tctl;
+	int gated_gpts;
+	int clk_was_enabled; /* state of our GPT clock before probe */
+	struct odo_sampler sampler;
 	unsigned long nb_access;
 	unsigned long first_access;
 	unsigned long last_access;
 };
 
 static struct _odo *odo;
+static DEFINE_MUTEX(odo_dev_lock); /* protects odo against probe/remove */
 int gpt_id = 2;
 module_param(gpt_id, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 MODULE_PARM_DESC(gpt_id, "General purpose timer ID (default 2)");
+static int idle_gpts = 0;
+module_param(idle_gpts, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(idle_gpts, "Mask of unused GPTs to clock gate, bit n-1 for GPT n (GPT1 excluded)");
+static struct odo_sample_param sample = { .lock = &odo_dev_lock };
+static struct platform_device *odo_pdev;
 
 /* Actions on the GPT */
 
@@ -118,22 +144,150 @@ static int odo_read_count(void)
 	return count;
 }
 
+/* Extends the 32 bits counter with the compare flag to 64 bits */
+static u64 odo_read_count64(void)
+{
+	unsigned long flags;
+	unsigned int status;
+	u64 count;
+
+	spin_lock_irqsave(&odo->lock, flags);
+	status = ioread32(odo->vmem + TSTAT_REG);
+	if (status & TSTAT_COMP) { /* Evaluate carry */
+		odo->counter_ms++;
+		iowrite32(TSTAT_COMP, odo->vmem + TSTAT_REG);
+	}
+	odo->counter_ls = odo_read_count();
+	count = odo->base + ((u64)odo->counter_ms << 32) + odo->counter_ls;
+	spin_unlock_irqrestore(&odo->lock, flags);
+
+	return count;
+}
+
+/* Gives the current count to other modules (used by odo_check) */
+int odo_get_count(u64 *count)
+{
+	int ret = 0;
+
+	mutex_lock(&odo_dev_lock);
+	if (odo)
+		*count = odo_read_count64();
+	else
+		ret = -ENODEV;
+	mutex_unlock(&odo_dev_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(odo_get_count);
+
+/* Only reads the GPT when someone is attached to odo:odo_sample */
+static int odo_sample_read(u64 *count)
+{
+	if (!trace_odo_sample_enabled())
+		return -EAGAIN;
+
+	*count = odo_read_count64();
+
+	return 0;
+}
+
+module_param_cb(sample_ms, &odo_sample_param_ops, &sample,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(sample_ms, "Period of the odo_sample trace event in milliseconds (default 0: disabled)");
+
 static int odo_reset_count(void)
 {
+	unsigned long flags;
+
+	spin_lock_irqsave(&odo->lock, flags);
+	odo->base = 0;
 	odo->counter_ms = 0;
 	odo->counter_ls = 0;
 
 	/* Disable the timer (resets the counter because CC bit is set) */
 	odo_set_gpt_field(TCTL_REG, TCTL_TEN, 0x0);
+	iowrite32(TSTAT_COMP, odo->vmem + TSTAT_REG); /* Drop a pending carry */
+	spin_unlock_irqrestore(&odo->lock, flags);
 
 	msleep(10);
 
 	/* Start counting */
+	spin_lock_irqsave(&odo->lock, flags);
 	odo_set_gpt_field(TCTL_REG, TCTL_TEN, 0x1);
+	spin_unlock_irqrestore(&odo->lock, flags);
 
 	return 0;
 }
 
+/*
+ * Gates or ungates the peripheral clock of a GPT, returns its previous state
+ * The region is only held during the access, like in imx27_internals
+ * PCCR0 is shared with the clock framework which updates it under its own
+ * spinlock: the i.MX27 is uniprocessor, so disabling interrupts around the
+ * read-modify-write is enough to not interleave with it
+ */
+static int odo_gpt_clock(int id, int enable)
+{
+	void __iomem *clocks;
+	unsigned long flags;
+	int was_enabled;
+	u32 v;
+
+	if (!request_mem_region(PCCR0, 4, "Peripheral clock control")) {
+		pr_err("odo: Unable to request region for PCCR0\n");
+		return -EBUSY;
+	}
+	clocks = ioremap_nocache(PCCR0, 4);
+	if (!clocks) {
+		pr_err("odo: Unable to map registers for PCCR0\n");
+		release_mem_region(PCCR0, 4);
+		return -ENOMEM;
+	}
+
+	local_irq_save(flags);
+	v = ioread32(clocks);
+	was_enabled = !!(v & PCCR0_GPT(id));
+	if (enable)
+		v |= PCCR0_GPT(id);
+	else
+		v &= ~PCCR0_GPT(id);
+	iowrite32(v, clocks);
+	local_irq_restore(flags);
+
+	iounmap(clocks);
+	release_mem_region(PCCR0, 4);
+
+	return was_enabled;
+}
+
+/*
+ * Gates the GPTs declared unused, never GPT1 (system timer) nor ours
+ * Only the ones that were clocked are remembered, to be restored on removal
+ */
+static void odo_gate_idle_gpts(void)
+{
+	int id;
+
+	for (id = 2; id <= 6; ++id) {
+		if (!(idle_gpts & (1 << (id - 1))) || (id == gpt_id))
+			continue;
+		if (odo_gpt_clock(id, false) <= 0)
+			continue;
+		odo->gated_gpts |= 1 << (id - 1);
+	}
+}
+
+static void odo_ungate_idle_gpts(void)
+{
+	int id;
+
+	for (id = 2; id <= 6; ++id) {
+		if (odo->gated_gpts & (1 << (id - 1)))
+			odo_gpt_clock(id, true);
+	}
+	odo->gated_gpts = 0;
+}
+
 
 static const struct of_device_id odo_dt_ids[] = {
 	{ .compatible = "nvp,odo", },
@@ -148,14 +302,7 @@ static ssize_t counter_show(struct kobject *kobj,
 			struct kobj_attribute *attr,
 			char *buf)
 {
-	unsigned long long counter_64;
-	unsigned int status = ioread32(odo->vmem + TSTAT_REG);
-	if (status & TSTAT_COMP) { /* Evaluate carry */
-		odo->counter_ms++;
-		iowrite32(TSTAT_COMP, odo->vmem + TSTAT_REG);
-	}
-	odo->counter_ls = odo_read_count();
-	counter_64 = ((u64)odo->counter_ms << 32) + odo->counter_ls;
+	unsigned long long counter_64 = odo_read_count64();
 	odo->nb_access++;
 	odo->last_access = jiffies;
 	if (odo->first_access == 0)
@@ -226,7 +373,57 @@ static struct attribute_group odo_attr_group =
 	.attrs = odo_attrs,
 };
 
-static int __init odo_init(void)
+/* Power management */
+
+/* Saves the 64 bits count and the GPT configuration before sleeping */
+static int odo_suspend(struct device *dev)
+{
+	odo->saved = odo_read_count64();
+	odo->saved_tctl = ioread32(odo->vmem + TCTL_REG);
+
+	return 0;
+}
+
+/*
+ * Called early during resume so that counting restarts as soon as possible
+ * If the GPT kept its context, it kept counting and nothing is touched
+ * Otherwise the count accumulated so far becomes the base of the new one
+ */
+static int odo_resume(struct device *dev)
+{
+	unsigned long flags;
+	int rc;
+
+	/* Registers cannot be read with the clock gated */
+	rc = odo_gpt_clock(gpt_id, true);
+	if (rc < 0) {
+		pr_err("odo: Cannot enable GPT %d clock\n", gpt_id);
+		return rc;
+	}
+
+	if (ioread32(odo->vmem + TCTL_REG) == odo->saved_tctl) {
+		odo_read_count64(); /* A carry may have happened meanwhile */
+		return 0;
+	}
+
+	pr_err("odo: GPT context lost during suspend, restarting the timer\n");
+	spin_lock_irqsave(&odo->lock, flags);
+	odo_timer_setup();
+	odo->base = odo->saved;
+	odo->counter_ms = 0;
+	odo->counter_ls = 0;
+	spin_unlock_irqrestore(&odo->lock, flags);
+
+	return 0;
+}
+
+static const struct dev_pm_ops odo_pm_ops = {
+	SET_LATE_SYSTEM_SLEEP_PM_OPS(odo_suspend, odo_resume)
+};
+
+/* Platform driver management */
+
+static int __init odo_probe(struct platform_device *pdev)
 {
 	int offset[] = MEM_GPT_OFFSET;
 	int gpio[] = GPT_TIN;
@@ -243,10 +440,17 @@ static int __init odo_init(void)
 		gpt_id = be32_to_cpup(of_get_property(node, "odo,timer", NULL));
 	}
 
+	mutex_lock(&odo_dev_lock);
 	odo = kzalloc(sizeof(struct _odo), GFP_KERNEL);
-	if (!odo)
+	if (!odo) {
+		mutex_unlock(&odo_dev_lock);
 		return -ENOMEM;
+	}
 
+	spin_lock_init(&odo->lock);
+	odo->sampler.read = odo_sample_read;
+	odo->sampler.emit = trace_odo_sample;
+	odo->sampler.wrap_mask = ~0ULL;
 	odo->gpt_base = MEM_BASE | offset[gpt_id - 1];
 	odo->counter_ms = 0;
 	odo->counter_ls = 0;
@@ -258,7 +462,6 @@ static int __init odo_init(void)
 		pr_err("odo: Impossible to reserve memory region\n");
 		rc = -ENOMEM;
 		goto free_alloc;
-		kfree(odo);
 	}
 
 	odo->vmem = (u32 *)ioremap_nocache(odo->gpt_base, MEM_LENGTH);
@@ -274,13 +477,22 @@ static int __init odo_init(void)
 		goto unmap;
 	}
 
+	/* Ungates the GPT clock (needed if module loaded after boot time) */
+	rc = odo_gpt_clock(gpt_id, true);
+	if (rc < 0) {
+		pr_err("odo: Cannot enable GPT %d clock\n", gpt_id);
+		goto free_gpio;
+	}
+	odo->clk_was_enabled = rc;
+
 	odo_timer_setup();
+	odo_gate_idle_gpts();
 
 	odo->kobj = kobject_create_and_add("odo", kernel_kobj->parent);
 	if (!odo->kobj)	{
 		pr_err("odo: Kobject creation failed\n");
 		rc = -ENOMEM;
-		goto free_gpio;
+		goto ungate;
 	}
 
 	if (sysfs_create_group(odo->kobj, &odo_attr_group)) {
@@ -289,10 +501,18 @@ static int __init odo_init(void)
 		goto put_kobj;
 	}
 
+	odo_sampler_attach(&sample, &odo->sampler);
+	mutex_unlock(&odo_dev_lock);
+
 	return 0;
 
 put_kobj:
 	kobject_put(odo->kobj);
+ungate:
+	odo_ungate_idle_gpts();
+	odo_set_gpt_field(TCTL_REG, TCTL_TEN, 0x0);
+	if (!odo->clk_was_enabled)
+		odo_gpt_clock(gpt_id, false);
 free_gpio:
 	gpio_free(gpio[gpt_id]);
 unmap:
@@ -301,20 +521,64 @@ release_region:
 	release_mem_region(odo->gpt_base, MEM_LENGTH);
 free_alloc:
 	kfree(odo);
+	odo = NULL;
+	mutex_unlock(&odo_dev_lock);
 
 	return rc;
 }
 
-static void __exit odo_exit(void)
+static int odo_remove(struct platform_device *pdev)
 {
 	int gpio[] = GPT_TIN;
 
+	/* odo_sample_read() does not take the lock, the work is stopped here */
+	mutex_lock(&odo_dev_lock);
+	odo_sampler_detach(&sample);
+	cancel_delayed_work_sync(&odo->sampler.work);
 	sysfs_remove_group(odo->kobj, &odo_attr_group);
 	kobject_put(odo->kobj);
+	odo_ungate_idle_gpts();
+	/* Stop counting, then gate the clock only if it was gated before */
+	odo_set_gpt_field(TCTL_REG, TCTL_TEN, 0x0);
+	if (!odo->clk_was_enabled)
+		odo_gpt_clock(gpt_id, false);
 	gpio_free(gpio[gpt_id]);
 	iounmap(odo->vmem);
 	release_mem_region(odo->gpt_base, MEM_LENGTH);
 	kfree(odo);
+	odo = NULL;
+	mutex_unlock(&odo_dev_lock);
+	return 0;
+}
+
+static struct platform_driver odo_driver = {
+	.driver = {
+		.name = "odo",
+		.pm   = &odo_pm_ops,
+	},
+	.remove = odo_remove,
+};
+
+static int __init odo_init(void)
+{
+	/*
+	 * The device is created here to keep /odo@0 and gpt_id semantics
+	 * Probe errors are returned, so they still fail the module loading
+	 */
+	odo_pdev = platform_create_bundle(&odo_driver, odo_probe, NULL, 0,
+					NULL, 0);
+	if (IS_ERR(odo_pdev)) {
+		pr_err("odo: Platform device creation failed\n");
+		return PTR_ERR(odo_pdev);
+	}
+
+	return 0;
+}
+
+static void __exit odo_exit(void)
+{
+	platform_device_unregister(odo_pdev);
+	platform_driver_unregister(&odo_driver);
 	return;
 }
 
@@ -0,0 +1,354 @@
+/*
+ * Cross-checks the pulses counted by the GPT (odo) and the PIC (picodo)
+ * Copyright (C) 2016  Miquèl Raynal
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Miquèl Raynal <miquel.raynal@navocap.com>");
+MODULE_DESCRIPTION("Monitors the divergence between GPT and PIC odometer counters");
+
+/* Exported by odo.c and picodo.c */
+int odo_get_count(u64 *count);
+int picodo_get_count(unsigned int *count);
+
+struct _check {
+	struct kobject *kobj;
+	struct delayed_work work;
+	struct mutex lock;
+	int synced;
+	u64 gpt_last;
+	u64 window_last; /* uncertainty on gpt_last */
+	unsigned int pic_last;
+	unsigned long sample_last;
+	long long drift; /* GPT pulses minus PIC pulses since last reset */
+	u64 gpt_missed; /* pulses beyond the sampling window, per path */
+	u64 pic_missed;
+	unsigned long gpt_max_rate; /* pulses/s, highest rate without loss */
+	unsigned long pic_max_rate;
+	unsigned long nb_samples;
+	unsigned long nb_errors;
+	int diverging;
+};
+
+static struct _check *check;
+static int period_ms = 1000;
+module_param(period_ms, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(period_ms, "Sampling period in milliseconds (default 1000)");
+static int threshold = 10;
+module_param(threshold, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(threshold, "Drift in pulses raising a divergence event (default 10)");
+
+/* Actions on the counters */
+
+/*
+ * Samples both counters as close as possible in time
+ * The I2C transfer is slow compared to a GPT read, so the GPT is read
+ * before and after it and the middle value is kept, the number of pulses
+ * between both reads is returned as the sampling window
+ */
+static int check_sample(u64 *gpt, unsigned int *pic, u64 *window)
+{
+	u64 before, after;
+	int ret;
+
+	ret = odo_get_count(&before);
+	if (ret < 0)
+		return ret;
+	ret = picodo_get_count(pic);
+	if (ret < 0)
+		return ret;
+	ret = odo_get_count(&after);
+	if (ret < 0)
+		return ret;
+
+	*window = after - before;
+	*gpt = before + *window / 2;
+
+	return 0;
+}
+
+static void check_raise_divergence(void)
+{
+	char env[40];
+	char *envp[] = { env, NULL };
+
+	snprintf(env, sizeof(env), "ODO_DRIFT=%lld", check->drift);
+	kobject_uevent_env(check->kobj, KOBJ_CHANGE, envp);
+	sysfs_notify(check->kobj, NULL, "drift");
+	pr_err("odo_check: GPT and PIC counters diverge (%lld pulses)\n",
+		check->drift);
+}
+
+static void check_update(u64 gpt, unsigned int pic, u64 window,
+			unsigned long now)
+{
+	u64 gpt_diff = gpt - check->gpt_last;
+	unsigned int pic_diff = pic - check->pic_last;
+	unsigned long elapsed_ms = jiffies_to_msecs(now - check->sample_last);
+	long long diff, tolerance;
+	unsigned long rate;
+
+	/* A counter went backward: one of them has been reset, resync */
+	if ((gpt < check->gpt_last) || (pic < check->pic_last) || !elapsed_ms)
+		return;
+
+	/*
+	 * The midpoints telescope, so the drift sums the raw differences
+	 * without accumulating the sampling error
+	 */
+	diff = (long long)gpt_diff - pic_diff;
+	check->nb_samples++;
+	check->drift += diff;
+
+	/*
+	 * Each midpoint is off by up to half its window, so a difference
+	 * within the largest window is not a loss, and only what goes beyond
+	 * is accounted as missed (losses on both paths do not cancel there)
+	 * The path that did not lose pulses sustained the observed rate
+	 */
+	tolerance = max(window, check->window_last);
+	if (diff > tolerance)
+		check->pic_missed += diff - tolerance;
+	else if (diff < -tolerance)
+		check->gpt_missed += -diff - tolerance;
+
+	if (diff <= tolerance) {
+		rate = div_u64((u64)pic_diff * 1000, elapsed_ms);
+		if (rate > check->pic_max_rate)
+			check->pic_max_rate = rate;
+	}
+	if (diff >= -tolerance) {
+		rate = div_u64(gpt_diff * 1000, elapsed_ms);
+		if (rate > check->gpt_max_rate)
+			check->gpt_max_rate = rate;
+	}
+
+	/* Only raise an event when entering the divergent state */
+	if ((check->drift > threshold) || (check->drift < -threshold)) {
+		if (!check->diverging)
+			check_raise_divergence();
+		check->diverging = true;
+	} else {
+		check->diverging = false;
+	}
+}
+
+static void check_work(struct work_struct *work)
+{
+	unsigned long now;
+	unsigned int pic;
+	u64 gpt, window;
+
+	mutex_lock(&check->lock);
+	now = jiffies;
+	if (check_sample(&gpt, &pic, &window) < 0) {
+		check->nb_errors++;
+		check->synced = false;
+		goto reschedule;
+	}
+
+	if (check->synced)
+		check_update(gpt, pic, window, now);
+
+	check->gpt_last = gpt;
+	check->window_last = window;
+	check->pic_last = pic;
+	check->sample_last = now;
+	check->synced = true;
+
+reschedule:
+	mutex_unlock(&check->lock);
+	queue_delayed_work(system_freezable_wq, &check->work,
+			msecs_to_jiffies(period_ms));
+}
+
+static void check_reset_stats(void)
+{
+	check->synced = false;
+	check->drift = 0;
+	check->gpt_missed = 0;
+	check->pic_missed = 0;
+	check->gpt_max_rate = 0;
+	check->pic_max_rate = 0;
+	check->nb_samples = 0;
+	check->nb_errors = 0;
+	check->diverging = false;
+}
+
+/* Sysfs management */
+
+static ssize_t drift_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%lld\n", check->drift);
+}
+
+/* Pulses counted by the PIC and not by the GPT */
+static ssize_t gpt_missed_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%llu\n", check->gpt_missed);
+}
+
+/* Pulses counted by the GPT and not by the PIC */
+static ssize_t pic_missed_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%llu\n", check->pic_missed);
+}
+
+static ssize_t gpt_max_rate_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%lu Hz\n", check->gpt_max_rate);
+}
+
+static ssize_t pic_max_rate_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%lu Hz\n", check->pic_max_rate);
+}
+
+static ssize_t nb_samples_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%lu\n", check->nb_samples);
+}
+
+static ssize_t nb_errors_show(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%lu\n", check->nb_errors);
+}
+
+static ssize_t reset_store(struct kobject *kobj,
+			struct kobj_attribute *attr,
+			const char *buf, size_t count)
+{
+	int ret;
+	int reset;
+
+	ret = kstrtoint(buf, 10, &reset);
+	if (ret < 0)
+		return ret;
+
+	if ((reset == 1) || (reset == '1')) {
+		mutex_lock(&check->lock);
+		check_reset_stats();
+		mutex_unlock(&check->lock);
+	}
+
+	return count;
+}
+
+static struct kobj_attribute check_drift_attr        = __ATTR_RO(drift);
+static struct kobj_attribute check_gpt_missed_attr   = __ATTR_RO(gpt_missed);
+static struct kobj_attribute check_pic_missed_attr   = __ATTR_RO(pic_missed);
+static struct kobj_attribute check_gpt_max_rate_attr = __ATTR_RO(gpt_max_rate);
+static struct kobj_attribute check_pic_max_rate_attr = __ATTR_RO(pic_max_rate);
+static struct kobj_attribute check_nb_samples_attr   = __ATTR_RO(nb_samples);
+static struct kobj_attribute check_nb_errors_attr    = __ATTR_RO(nb_errors);
+static struct kobj_attribute check_reset_attr        = __ATTR_WO(reset);
+
+static struct attribute *check_attrs[] =
+{
+	&check_drift_attr.attr,
+	&check_gpt_missed_attr.attr,
+	&check_pic_missed_attr.attr,
+	&check_gpt_max_rate_attr.attr,
+	&check_pic_max_rate_attr.attr,
+	&check_nb_samples_attr.attr,
+	&check_nb_errors_attr.attr,
+	&check_reset_attr.attr,
+	NULL,
+};
+
+static struct attribute_group check_attr_group =
+{
+	.name = NULL,
+	.attrs = check_attrs,
+};
+
+static int __init check_init(void)
+{
+	int rc = 0;
+
+	if (period_ms <= 0)
+		return -EINVAL;
+
+	check = kzalloc(sizeof(struct _check), GFP_KERNEL);
+	if (!check)
+		return -ENOMEM;
+
+	mutex_init(&check->lock);
+	INIT_DELAYED_WORK(&check->work, check_work);
+	check_reset_stats();
+
+	check->kobj = kobject_create_and_add("odo_check", kernel_kobj->parent);
+	if (!check->kobj) {
+		pr_err("odo_check: Kobject creation failed\n");
+		rc = -ENOMEM;
+		goto free_alloc;
+	}
+
+	if (sysfs_create_group(check->kobj, &check_attr_group)) {
+		pr_err("odo_check: Sysfs group creation failed\n");
+		rc = -ENOMEM;
+		goto put_kobj;
+	}
+
+	queue_delayed_work(system_freezable_wq, &check->work, 0);
+
+	return 0;
+
+put_kobj:
+	kobject_put(check->kobj);
+free_alloc:
+	kfree(check);
+
+	return rc;
+}
+
+static void __exit check_exit(void)
+{
+	cancel_delayed_work_sync(&check->work);
+	sysfs_remove_group(check->kobj, &check_attr_group);
+	kobject_put(check->kobj);
+	kfree(check);
+	return;
+}
+
+module_init(check_init);
+module_exit(check_exit);
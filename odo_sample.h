@@ -0,0 +1,132 @@
+/*
+ * Periodic sampling of an odometer counter into its trace event
+ * Copyright (C) 2016  Miquèl Raynal
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#ifndef _ODO_SAMPLE_H
+#define _ODO_SAMPLE_H
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/moduleparam.h>
+
+/*
+ * Consumers attach BPF programs to the odo_trace.h events to filter the
+ * stream in the kernel instead of polling the sysfs counter
+ */
+struct odo_sampler {
+	struct delayed_work work;
+	struct odo_sample_param *param;
+	int (*read)(u64 *count); /* fails when the event is not enabled */
+	void (*emit)(u64 count, u64 delta, unsigned int period_ms);
+	u64 wrap_mask; /* width of the hardware counter */
+	u64 last;
+	int valid;
+};
+
+/* Argument of the sample_ms module parameter */
+struct odo_sample_param {
+	int period_ms; /* 0: sampling stopped */
+	struct mutex *lock; /* device lock of the module, protects sampler */
+	struct odo_sampler *sampler; /* NULL while no device is bound */
+};
+
+static void odo_sampler_work(struct work_struct *work)
+{
+	struct odo_sampler *s = container_of(work, struct odo_sampler,
+					work.work);
+	int period_ms = s->param->period_ms;
+	u64 count;
+
+	if (!period_ms)
+		return;
+
+	if (!s->read(&count)) {
+		if (!s->valid)
+			s->last = count;
+		else if ((s->wrap_mask == ~0ULL) && (count < s->last))
+			s->last = 0; /* 64 bits never wrap: counter reset */
+		s->emit(count, (count - s->last) & s->wrap_mask, period_ms);
+		s->last = count;
+		s->valid = true;
+	} else {
+		s->valid = false;
+	}
+
+	queue_delayed_work(system_freezable_wq, &s->work,
+			msecs_to_jiffies(period_ms));
+}
+
+/* Called with the device lock held, once the counter can be read */
+static inline void odo_sampler_attach(struct odo_sample_param *p,
+				struct odo_sampler *s)
+{
+	INIT_DELAYED_WORK(&s->work, odo_sampler_work);
+	s->param = p;
+	s->valid = false;
+	p->sampler = s;
+	if (p->period_ms > 0)
+		queue_delayed_work(system_freezable_wq, &s->work, 0);
+}
+
+/*
+ * Called with the device lock held, the work must then be stopped with
+ * cancel_delayed_work_sync(), after releasing the lock if read() takes it
+ */
+static inline void odo_sampler_detach(struct odo_sample_param *p)
+{
+	p->sampler = NULL;
+}
+
+/* Starts or stops the sampling, never waits for the work */
+static int odo_sample_param_set(const char *val, const struct kernel_param *kp)
+{
+	struct odo_sample_param *p = kp->arg;
+	int ret, ms;
+
+	ret = kstrtoint(val, 10, &ms);
+	if (ret < 0)
+		return ret;
+	if (ms < 0)
+		return -EINVAL;
+
+	mutex_lock(p->lock);
+	p->period_ms = ms;
+	if (p->sampler && (ms > 0))
+		mod_delayed_work(system_freezable_wq, &p->sampler->work, 0);
+	mutex_unlock(p->lock);
+
+	return 0;
+}
+
+static int odo_sample_param_get(char *buffer, const struct kernel_param *kp)
+{
+	struct odo_sample_param *p = kp->arg;
+
+	return scnprintf(buffer, PAGE_SIZE, "%d\n", p->period_ms);
+}
+
+static const struct kernel_param_ops odo_sample_param_ops = {
+	.set = odo_sample_param_set,
+	.get = odo_sample_param_get,
+};
+
+#endif /* _ODO_SAMPLE_H */
@@ -0,0 +1,75 @@
+/*
+ * Trace events of the odometer counters, BPF programs may attach to them
+ * Copyright (C) 2016  Miquèl Raynal
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM odo
+
+#if !defined(_ODO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ODO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Periodic sample: total count and pulses since the previous sample */
+DECLARE_EVENT_CLASS(odo_sample_class,
+
+	TP_PROTO(u64 count, u64 delta, unsigned int period_ms),
+
+	TP_ARGS(count, delta, period_ms),
+
+	TP_STRUCT__entry(
+		__field(u64, count)
+		__field(u64, delta)
+		__field(unsigned int, period_ms)
+	),
+
+	TP_fast_assign(
+		__entry->count = count;
+		__entry->delta = delta;
+		__entry->period_ms = period_ms;
+	),
+
+	TP_printk("count=%llu delta=%llu period_ms=%u",
+		__entry->count, __entry->delta, __entry->period_ms)
+);
+
+/*
+ * Each module only defines its own event, so that both can be loaded
+ * picodo.c defines TRACE_PICODO before including this file
+ */
+#ifdef TRACE_PICODO
+DEFINE_EVENT(odo_sample_class, picodo_sample,
+	TP_PROTO(u64 count, u64 delta, unsigned int period_ms),
+	TP_ARGS(count, delta, period_ms)
+);
+#else
+DEFINE_EVENT(odo_sample_class, odo_sample,
+	TP_PROTO(u64 count, u64 delta, unsigned int period_ms),
+	TP_ARGS(count, delta, period_ms)
+);
+#endif
+
+#endif /* _ODO_TRACE_H */
+
+/* Kbuild needs CFLAGS_odo.o and CFLAGS_picodo.o := -I$(src) to find this file */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE odo_trace
+#include <trace/define_trace.h>
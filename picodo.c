@@ -28,6 +28,14 @@
 #include <linux/gpio.h>
 #include <linux/delay.h>
 #include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include "err_summary.h"
+
+#define CREATE_TRACE_POINTS
+#define TRACE_PICODO
+#include "odo_trace.h"
+#include "odo_sample.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Miquèl Raynal <miquel.raynal@navocap.com>");
@@ -46,9 +54,20 @@ struct picodo_chip
 	int nb_access;
 	unsigned long first_access;
 	unsigned long last_access;
+	struct err_summary i2c_errors;
+	struct err_summary gpio_errors;
+	struct odo_sampler sampler;
 };
 
 static struct picodo_chip *chip;
+static DEFINE_MUTEX(picodo_dev_lock); /* protects chip against probe/remove */
+static char *kobj_name = "odo";
+module_param(kobj_name, charp, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(kobj_name, "Name of the sysfs directory (default odo, change it if odo.c is also loaded)");
+static int err_interval_ms = 10000;
+module_param(err_interval_ms, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(err_interval_ms, "Interval between two error summaries in milliseconds (default 10000)");
+static struct odo_sample_param sample = { .lock = &picodo_dev_lock };
 
 /* Actions on the chip */
 
@@ -59,7 +78,7 @@ static int picodo_read_reg(struct picodo_chip *chip, int reg, int *storage)
 	for (byte = 0; byte < 4; ++byte) {
 		ret = i2c_smbus_read_byte_data(chip->client, reg + byte);
 		if (ret < 0) {
-			pr_err("error reading byte 0x%X.\n", reg + byte);
+			err_summary_count(&chip->i2c_errors, ret);
 			return ret;
 		}
 		v += ret << (byte * 8);
@@ -70,13 +89,59 @@ static int picodo_read_reg(struct picodo_chip *chip, int reg, int *storage)
 	return ret;
 }
 
+/* Gives the current count to other modules (used by odo_check) */
+int picodo_get_count(unsigned int *count)
+{
+	int ret, v;
+
+	mutex_lock(&picodo_dev_lock);
+	if (!chip) {
+		mutex_unlock(&picodo_dev_lock);
+		return -ENODEV;
+	}
+	mutex_lock(&chip->lock);
+	ret = picodo_read_reg(chip, REG_CNT, &v);
+	mutex_unlock(&chip->lock);
+	mutex_unlock(&picodo_dev_lock);
+	if (ret < 0)
+		return ret;
+
+	*count = v;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(picodo_get_count);
+
+/* Only reads the PIC when someone is attached to odo:picodo_sample */
+static int picodo_sample_read(u64 *count)
+{
+	unsigned int v;
+	int ret;
+
+	if (!trace_picodo_sample_enabled())
+		return -EAGAIN;
+
+	ret = picodo_get_count(&v);
+	if (ret < 0)
+		return ret;
+
+	*count = v;
+
+	return 0;
+}
+
+module_param_cb(sample_ms, &odo_sample_param_ops, &sample,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(sample_ms, "Period of the picodo_sample trace event in milliseconds (default 0: disabled)");
+
+/* Must be called with chip->lock held once the chip is probed */
 static int picodo_reset(struct picodo_chip *chip)
 {
 	int ret;
 
 	ret = gpio_direction_output(chip->gpio_reset, 0);
 	if(ret < 0) {
-		pr_err("Cannot change reset gpio direction to output.\n");
+		err_summary_count(&chip->gpio_errors, ret);
 		goto end;
 	}
 	msleep(10);
@@ -94,18 +159,29 @@ static int picodo_probe(struct i2c_client *client, const struct i2c_device_id *i
 {
 	int rc;
 
+	mutex_lock(&picodo_dev_lock);
 	chip = devm_kzalloc(&client->dev, sizeof(struct picodo_chip), GFP_KERNEL);
-	if (!chip)
+	if (!chip) {
+		mutex_unlock(&picodo_dev_lock);
 		return -ENOMEM;
+	}
 
 	chip->client = client;
 	mutex_init(&chip->lock);
+	err_summary_init(&chip->i2c_errors, "picodo: I2C", err_interval_ms);
+	err_summary_init(&chip->gpio_errors, "picodo: reset GPIO",
+			err_interval_ms);
+	chip->sampler.read = picodo_sample_read;
+	chip->sampler.emit = trace_picodo_sample;
+	chip->sampler.wrap_mask = 0xFFFFFFFF; /* 32 bits PIC counter */
 	chip->gpio_reset = be32_to_cpup(
 		of_get_property(client->dev.of_node, "gpio-reset", NULL)
 		);
 	rc = gpio_request_one(chip->gpio_reset, GPIOF_IN, "picodo-reset");
 	if(rc < 0) {
 		pr_err("Cannot reserve reset GPIO %d\n", chip->gpio_reset);
+		chip = NULL; /* Freed by devm */
+		mutex_unlock(&picodo_dev_lock);
 		return rc;
 	}
 
@@ -117,12 +193,27 @@ static int picodo_probe(struct i2c_client *client, const struct i2c_device_id *i
 	picodo_reset(chip);
 
 	i2c_set_clientdata(client, chip);
+	odo_sampler_attach(&sample, &chip->sampler);
+	mutex_unlock(&picodo_dev_lock);
 	return 0;
 }
 
 static int picodo_remove(struct i2c_client *client)
 {
-	gpio_free(chip->gpio_reset);
+	struct picodo_chip *c = i2c_get_clientdata(client);
+
+	/* Unpublish the chip first, so that no one can reach it anymore */
+	mutex_lock(&picodo_dev_lock);
+	odo_sampler_detach(&sample);
+	chip = NULL;
+	mutex_unlock(&picodo_dev_lock);
+
+	/* Not under the lock: picodo_sample_read() takes it */
+	cancel_delayed_work_sync(&c->sampler.work);
+	/* Flush the pending summary before the chip is freed */
+	err_summary_flush(&c->i2c_errors);
+	err_summary_flush(&c->gpio_errors);
+	gpio_free(c->gpio_reset);
 	return 0;
 }
 
@@ -156,12 +247,18 @@ static ssize_t counter_show(struct kobject *kobj,
 			struct kobj_attribute *attr,
 			char *buf)
 {
-	int ret = picodo_read_reg(chip, REG_CNT, &chip->counter);
+	int ret;
+
+	/* Held across the reset so that no other reader interleaves with it */
+	mutex_lock(&chip->lock);
+	ret = picodo_read_reg(chip, REG_CNT, &chip->counter);
 	if (ret < 0) {
 		picodo_reset(chip);
+		mutex_unlock(&chip->lock);
 		chip->nb_access = 0;
 		return ret;
 	}
+	mutex_unlock(&chip->lock);
 
 	chip->nb_access++;
 	chip->last_access = jiffies;
@@ -214,7 +311,9 @@ static ssize_t reset_store(struct kobject *kobj,
 		return ret;
 
 	if ((reset == 1) || (reset == '1')) {
+		mutex_lock(&chip->lock);
 		picodo_reset(chip);
+		mutex_unlock(&chip->lock);
 		chip->nb_access = 0;
 		chip->first_access = 0;
 		chip->last_access = 0;
@@ -251,13 +350,16 @@ static int __init picodo_init(void)
 {
 	int rc;
 
+	if (err_interval_ms <= 0)
+		return -EINVAL;
+
 	rc = i2c_add_driver(&picodo_driver);
 	if (rc < 0) {
 		pr_err("I2C add driver failed\n");
 		goto err_add_drv;
 	}
 
-	picodo_kobj = kobject_create_and_add("odo", kernel_kobj->parent);
+	picodo_kobj = kobject_create_and_add(kobj_name, kernel_kobj->parent);
 	if (!picodo_kobj) {
 		pr_err("Kobject creation failed\n");
 		rc = -ENOMEM;
@@ -29,6 +29,9 @@
 #include <linux/delay.h>
 #include <linux/time.h>
 #include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include "err_summary.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Miquèl Raynal <miquel.raynal@navocap.com>");
@@ -42,9 +45,22 @@ struct _wd {
 	unsigned int period_s;
 	unsigned int last_trig_s;
 	int stopped;
+	struct err_summary gpio_errors; /* GPIOs are on an I2C expander */
 };
 
 static struct _wd *wd;
+static int err_interval_ms = 10000;
+module_param(err_interval_ms, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(err_interval_ms, "Interval between two error summaries in milliseconds (default 10000)");
+
+/* Failing GPIO reads only bump a counter, summarized by a deferred work */
+static int wd_get_value(int gpio)
+{
+	int v = gpio_get_value_cansleep(gpio);
+	if (v < 0)
+		err_summary_count(&wd->gpio_errors, v);
+	return v;
+}
 
 /* Actions on the watchdog */
 
@@ -59,7 +75,7 @@ static void wd_trig(void)
 
 static int wd_has_inhib(void)
 {
-	return gpio_get_value_cansleep(wd->gpio_inhib);
+	return wd_get_value(wd->gpio_inhib);
 }
 
 static int wd_has_clock(void)
@@ -67,11 +83,11 @@ static int wd_has_clock(void)
 	int clk[3];
 	int has_clk = false;
 
-	clk[0] = gpio_get_value_cansleep(wd->gpio_clock);
+	clk[0] = wd_get_value(wd->gpio_clock);
 	msleep(400);
-	clk[1] = gpio_get_value_cansleep(wd->gpio_clock);
+	clk[1] = wd_get_value(wd->gpio_clock);
 	msleep(400);
-	clk[2] = gpio_get_value_cansleep(wd->gpio_clock);
+	clk[2] = wd_get_value(wd->gpio_clock);
 
 	if((clk[0] != clk[1]) || (clk[1] != clk[2]))
 		has_clk = true;
@@ -172,6 +188,9 @@ static int __init wd_init(void)
 	struct device_node *node;
 	int rc;
 
+	if (err_interval_ms <= 0)
+		return -EINVAL;
+
 	node = of_find_node_by_path("/wd@0");
 	if (!node) {
 		pr_err("Find node by path failed.\n");
@@ -186,6 +205,7 @@ static int __init wd_init(void)
 	wd->gpio_trig = be32_to_cpup(of_get_property(node, "wd,gpio_trig", NULL));
 	wd->period_s = be32_to_cpup(of_get_property(node, "wd,period_s", NULL));
 	wd->last_trig_s = jiffies / HZ;
+	err_summary_init(&wd->gpio_errors, "wd: GPIO", err_interval_ms);
 
 	if (!(gpio_is_valid(wd->gpio_inhib))
 		|| !(gpio_is_valid(wd->gpio_clock))
@@ -248,6 +268,8 @@ static void __exit wd_exit(void)
 {
 	sysfs_remove_group(wd->kobj, &wd_attr_group);
 	kobject_put(wd->kobj);
+	/* Flush the pending summary before wd is freed */
+	err_summary_flush(&wd->gpio_errors);
 	gpio_free(wd->gpio_clock);
 	gpio_free(wd->gpio_inhib);
 	gpio_free(wd->gpio_trig);